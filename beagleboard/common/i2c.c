@@ -5,7 +5,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
-//#include <pthread.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -15,7 +15,7 @@
 
 // It looks like bad things happen if you attempt to read and write to the same I2C bus
 // at the same time, even through different handles.
-//pthread_mutex_t i2c_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t i2c_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int open_i2c(int bus, bool quiet) {
 	char devicePath[20];
@@ -38,20 +38,21 @@ int read_i2c(int handle, uint8_t address, uint8_t reg, bool quiet) {
 
 	if (!quiet) printf("Reading from I2C at address %d, register=%d\n", address, reg);
 
-	//pthread_mutex_lock(&i2c_mutex);
+	pthread_mutex_lock(&i2c_mutex);
 
 	if (ioctl(handle, I2C_SLAVE, address) < 0) {
 		if (!quiet) perror("Failed setting slave address"); 
-		//pthread_mutex_unlock(&i2c_mutex);
+		pthread_mutex_unlock(&i2c_mutex);
 		return -1;
 	}
 
 	r = i2c_smbus_read_byte_data(handle, reg);
 	if (r < 0) {
 		if (!quiet) perror("Failed to read value from I2C bus"); 
-		//pthread_mutex_unlock(&i2c_mutex);
+		pthread_mutex_unlock(&i2c_mutex);
 		return -1;
 	}
+	pthread_mutex_unlock(&i2c_mutex);
 
 	if (!quiet) printf("  Read i2c value %d\n", r);
 
@@ -63,11 +64,11 @@ int read_i2c_multiple(int handle, uint8_t address, uint8_t reg, int count, bool
 
 	if (!quiet) printf("Reading from I2C at address %d, register=%d\n", address, reg);
 
-	//pthread_mutex_lock(&i2c_mutex);
+	pthread_mutex_lock(&i2c_mutex);
 
 	if (ioctl(handle, I2C_SLAVE, address) < 0) {
 		if (!quiet) perror("Failed setting slave address"); 
-		//pthread_mutex_unlock(&i2c_mutex);
+		pthread_mutex_unlock(&i2c_mutex);
 		return -1;
 	}
 
@@ -75,10 +76,10 @@ int read_i2c_multiple(int handle, uint8_t address, uint8_t reg, int count, bool
 	r = i2c_smbus_read_i2c_block_data(handle, reg, count, result);
 	if (r < 0) {
 		if (!quiet) perror("Failed to read value from the I2C bus"); 
-		//pthread_mutex_unlock(&i2c_mutex);
+		pthread_mutex_unlock(&i2c_mutex);
 		return -1;
 	}
-	//pthread_mutex_unlock(&i2c_mutex);
+	pthread_mutex_unlock(&i2c_mutex);
 
 	return 0;
 }
@@ -89,10 +90,10 @@ int write_i2c(int handle, uint8_t address, uint8_t reg, uint8_t value, bool quie
 	if (!quiet) printf("Writing value %d to I2C at address=%d, register=%d\n", value, address, reg);
 	if (!quiet) printf("  Setting slave address to %d\n", address);
 
-	//pthread_mutex_lock(&i2c_mutex);
+	pthread_mutex_lock(&i2c_mutex);
 
 	if (ioctl(handle, I2C_SLAVE, address) < 0) {
-		//pthread_mutex_unlock(&i2c_mutex);
+		pthread_mutex_unlock(&i2c_mutex);
 		if (!quiet) perror("ERROR: Failed setting slave address\n"); 
 		return -1;
 	}
@@ -100,14 +101,82 @@ int write_i2c(int handle, uint8_t address, uint8_t reg, uint8_t value, bool quie
 	if (!quiet) printf("  Writing register %d and value %d to I2C bus\n", reg, value);
 	r = i2c_smbus_write_byte_data(handle, reg, value);
 	if (r < 0) {
+		pthread_mutex_unlock(&i2c_mutex);
 		if (!quiet) perror("ERROR:Failed to write register and value to the I2C bus\n"); 
 		return -1;
 	}
 
-	//pthread_mutex_unlock(&i2c_mutex);
+	pthread_mutex_unlock(&i2c_mutex);
 	
 	if (!quiet) printf("  Write successful\n");
 
 	return 0;
 }
 
+int write_i2c_multiple(int handle, uint8_t address, uint8_t reg, int count, const uint8_t *values, bool quiet) {
+	__s32 r;
+
+	if (!quiet) printf("Writing %d values to I2C at address=%d, register=%d\n", count, address, reg);
+
+	if (count < 1 || count > MAX_I2C_BLOCK_WRITE) {
+		if (!quiet) fprintf(stderr, "ERROR: Can't write %d registers in one transaction\n", count);
+		return -1;
+	}
+
+	pthread_mutex_lock(&i2c_mutex);
+
+	if (ioctl(handle, I2C_SLAVE, address) < 0) {
+		pthread_mutex_unlock(&i2c_mutex);
+		if (!quiet) perror("ERROR: Failed setting slave address\n"); 
+		return -1;
+	}
+
+	if (!quiet) printf("  Writing register %d and %d values to I2C bus\n", reg, count);
+	r = i2c_smbus_write_i2c_block_data(handle, reg, count, values);
+	if (r < 0) {
+		pthread_mutex_unlock(&i2c_mutex);
+		if (!quiet) perror("ERROR: Failed to write register and values to the I2C bus\n"); 
+		return -1;
+	}
+
+	pthread_mutex_unlock(&i2c_mutex);
+	
+	if (!quiet) printf("  Write successful\n");
+
+	return 0;
+}
+
+int transfer_i2c(int handle, struct i2c_message *messages, int count, bool quiet) {
+	struct i2c_msg msgs[MAX_I2C_MESSAGES];
+	struct i2c_rdwr_ioctl_data data;
+	int i;
+
+	if (count < 1 || count > MAX_I2C_MESSAGES) {
+		if (!quiet) fprintf(stderr, "ERROR: Can't transfer %d messages in one transaction\n", count);
+		return -1;
+	}
+
+	if (!quiet) printf("Transferring %d I2C messages in one transaction\n", count);
+	for (i = 0; i < count; i++) {
+		msgs[i].addr = messages[i].address;
+		msgs[i].flags = messages[i].read ? I2C_M_RD : 0;
+		msgs[i].len = messages[i].length;
+		msgs[i].buf = (char*)messages[i].buffer;
+		if (!quiet) printf("  %s %d byte(s) at address %d\n", messages[i].read ? "Reading" : "Writing", 
+				messages[i].length, messages[i].address);
+	}
+	data.msgs = msgs;
+	data.nmsgs = count;
+
+	pthread_mutex_lock(&i2c_mutex);
+	if (ioctl(handle, I2C_RDWR, &data) < 0) {
+		pthread_mutex_unlock(&i2c_mutex);
+		if (!quiet) perror("ERROR: Failed to transfer the I2C messages\n"); 
+		return -1;
+	}
+	pthread_mutex_unlock(&i2c_mutex);
+
+	if (!quiet) printf("  Transfer successful\n");
+
+	return 0;
+}
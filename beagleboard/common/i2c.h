@@ -1,4 +1,4 @@
-#ifndef MYI2C_h
+#ifndef MYI2C_H
 #define MYI2C_H
 
 #include <stdbool.h>
@@ -9,4 +9,27 @@ int read_i2c(int handle, uint8_t address, uint8_t reg, bool quiet);
 int read_i2c_multiple(int handle, uint8_t address, uint8_t reg, int count, bool quiet, uint8_t *result);
 int write_i2c(int handle, uint8_t address, uint8_t reg, uint8_t value, bool quiet);
 
+/* The most sequential registers write_i2c_multiple can write in one transaction. */
+#define MAX_I2C_BLOCK_WRITE 32
+
+int write_i2c_multiple(int handle, uint8_t address, uint8_t reg, int count, const uint8_t *values, bool quiet);
+
+/* The most messages the kernel accepts in one combined transaction. */
+#define MAX_I2C_MESSAGES 42
+
+/* One message in a combined transaction. */
+struct i2c_message
+{
+	uint8_t address;
+	bool read;
+	uint16_t length;
+	uint8_t *buffer;
+};
+
+/* 
+   Performs a list of reads and writes, possibly to different slaves, as a single combined transaction 
+   (one syscall, with repeated starts between the messages). Returns 0 if successful, or -1 otherwise.
+*/
+int transfer_i2c(int handle, struct i2c_message *messages, int count, bool quiet);
+
 #endif
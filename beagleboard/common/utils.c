@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
+#include "utils.h"
 
 long get_time_in_ms() 
 {
@@ -12,6 +13,13 @@ long get_time_in_ms()
 	return (long)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
 }
 
+int64_t get_time_in_us() 
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 void fatal(const char *message,...)
 {
 	va_list argp;
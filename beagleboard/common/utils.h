@@ -1,8 +1,11 @@
 #ifndef UTILITIES_H
 #define UTILITIES_H
 
+#include <stdint.h>
+
 long get_time_in_ms();
-void fatal(char *message, ...);
+int64_t get_time_in_us();
+void fatal(const char *message, ...);
 void fatal_errno(const char *message);
 
 #endif
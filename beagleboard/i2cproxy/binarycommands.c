@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "binarycommands.h"
+#include "commands.h"
+#include "pollcommands.h"
+
+static inline uint16_t get_le16(const uint8_t *buffer)
+{
+	return buffer[0] | buffer[1] << 8;
+}
+
+static inline uint32_t get_le32(const uint8_t *buffer)
+{
+	return buffer[0] | buffer[1] << 8 | buffer[2] << 16 | (uint32_t)buffer[3] << 24;
+}
+
+static inline void put_le16(uint8_t *buffer, uint16_t value)
+{
+	buffer[0] = value;
+	buffer[1] = value >> 8;
+}
+
+static inline void put_le32(uint8_t *buffer, uint32_t value)
+{
+	buffer[0] = value;
+	buffer[1] = value >> 8;
+	buffer[2] = value >> 16;
+	buffer[3] = value >> 24;
+}
+
+int get_binary_frame_size(const uint8_t *buffer, int count)
+{
+	int payload_length;
+
+	if (count < BINARY_HEADER_SIZE) return 0;
+
+	payload_length = get_le16(&buffer[2]);
+	if (payload_length > MAX_BINARY_PAYLOAD) {
+		fprintf(stderr, "ERROR => Binary request payload of %d bytes is too long.\n", payload_length);
+		return -1;
+	}
+
+	return BINARY_HEADER_SIZE + payload_length;
+}
+
+/* Fills in the response header, returning the size of the whole response frame. */
+static int make_binary_reply(uint8_t *reply, uint8_t opcode, uint8_t status, int payload_length)
+{
+	reply[0] = opcode;
+	reply[1] = status;
+	put_le16(&reply[2], payload_length);
+	return BINARY_HEADER_SIZE + payload_length;
+}
+
+/* Reads every register block in one combined transaction. Returns the response payload length, or -1. */
+static int process_binary_mget(const uint8_t *payload, int payload_length, int i2c_handle, uint8_t *reply_payload)
+{
+	struct register_block blocks[MAX_REGISTER_BLOCKS];
+	int num_blocks = payload_length / MGET_BLOCK_SIZE;
+	int reply_length = 0;
+	int i;
+
+	for (i = 0; i < num_blocks; i++) {
+		blocks[i].address = payload[i * MGET_BLOCK_SIZE];
+		blocks[i].reg = payload[i * MGET_BLOCK_SIZE + 1];
+		blocks[i].count = payload[i * MGET_BLOCK_SIZE + 2];
+		if (blocks[i].count == 0) {
+			fprintf(stderr, "ERROR => Register blocks must contain at least one register.\n");
+			return -1;
+		}
+		reply_length += blocks[i].count;
+	}
+
+	if (reply_length > MAX_BINARY_PAYLOAD) {
+		fprintf(stderr, "ERROR => Too many registers requested to fit in the reply.\n");
+		return -1;
+	}
+	if (read_i2c_register_blocks(i2c_handle, blocks, num_blocks, reply_payload) != 0) return -1;
+
+	return reply_length;
+}
+
+/* 
+   The payload lengths a request may have: between min and max bytes, made up of a fixed part of min bytes
+   followed by any number of unit byte parts.
+*/
+struct payload_length_rule
+{
+	int min;
+	int max;
+	int unit;
+};
+
+/* Looks up the payload length rule for an opcode. Returns false for unknown opcodes. */
+static bool get_payload_length_rule(uint8_t opcode, struct payload_length_rule *rule)
+{
+	static const struct payload_length_rule ping = { 0, 0, 1 };
+	static const struct payload_length_rule get = { 3, 3, 1 };
+	static const struct payload_length_rule set = { 3, 3, 1 };
+	static const struct payload_length_rule addpoll = { ADDPOLL_PAYLOAD_SIZE, ADDPOLL_DELTA_PAYLOAD_SIZE, 
+		ADDPOLL_DELTA_PAYLOAD_SIZE - ADDPOLL_PAYLOAD_SIZE };
+	static const struct payload_length_rule rmpoll = { 4, 4, 1 };
+	static const struct payload_length_rule batch = { BATCH_OPERATION_SIZE, MAX_BINARY_PAYLOAD, 
+		BATCH_OPERATION_SIZE };
+	static const struct payload_length_rule mget = { MGET_BLOCK_SIZE, MGET_BLOCK_SIZE * MAX_REGISTER_BLOCKS, 
+		MGET_BLOCK_SIZE };
+	static const struct payload_length_rule setn = { 3, 2 + MAX_I2C_BLOCK_WRITE, 1 };
+
+	switch (opcode) {
+	case BINARY_PING: *rule = ping; return true;
+	case BINARY_GET: *rule = get; return true;
+	case BINARY_SET: *rule = set; return true;
+	case BINARY_ADDPOLL: *rule = addpoll; return true;
+	case BINARY_RMPOLL: *rule = rmpoll; return true;
+	case BINARY_BATCH: *rule = batch; return true;
+	case BINARY_MGET: *rule = mget; return true;
+	case BINARY_SETN: *rule = setn; return true;
+	default: return false;
+	}
+}
+
+/* Runs each get/set operation in a batch back to back. Returns the response payload length, or -1. */
+static int process_binary_batch(const uint8_t *payload, int payload_length, int i2c_handle, uint8_t *reply_payload)
+{
+	const uint8_t *operation;
+	uint8_t *status;
+	int reply_length = 0;
+
+	for (operation = payload; operation < payload + payload_length; operation += BATCH_OPERATION_SIZE) {
+
+		if (operation[0] == BINARY_GET && reply_length + 1 + operation[3] > MAX_BINARY_PAYLOAD ||
+				reply_length + 1 > MAX_BINARY_PAYLOAD) {
+			fprintf(stderr, "ERROR => Batch results are too long for the reply buffer.\n");
+			return -1;
+		}
+
+		status = &reply_payload[reply_length++];
+		*status = BINARY_ERROR;
+		if (operation[0] == BINARY_GET) {
+			if (read_i2c_registers(i2c_handle, operation[1], operation[2], operation[3], 
+						&reply_payload[reply_length]) == 0) {
+				*status = BINARY_OK;
+				reply_length += operation[3];
+			}
+		}
+		else if (operation[0] == BINARY_SET) {
+			if (write_i2c_register(i2c_handle, operation[1], operation[2], operation[3]) == 0) 
+				*status = BINARY_OK;
+		}
+		else {
+			fprintf(stderr, "ERROR => Batches can only contain get and set operations, not opcode %d.\n", 
+					operation[0]);
+		}
+	}
+
+	return reply_length;
+}
+
+int process_binary_request(const uint8_t *request, int i2c_handle, uint8_t *reply)
+{
+	uint8_t opcode = request[0];
+	int payload_length = get_le16(&request[2]);
+	const uint8_t *payload = &request[BINARY_HEADER_SIZE];
+	uint8_t *reply_payload = &reply[BINARY_HEADER_SIZE];
+	struct payload_length_rule rule;
+	struct poll_delivery delivery;
+	int reply_length;
+
+	if (!get_payload_length_rule(opcode, &rule)) {
+		fprintf(stderr, "ERROR => Unknown binary opcode %d.\n", opcode);
+		return make_binary_reply(reply, opcode, BINARY_ERROR, 0);
+	}
+	if (payload_length < rule.min || payload_length > rule.max || (payload_length - rule.min) % rule.unit != 0) {
+		fprintf(stderr, "ERROR => Incorrect payload length %d for binary opcode %d.\n", payload_length, opcode);
+		return make_binary_reply(reply, opcode, BINARY_ERROR, 0);
+	}
+
+	switch (opcode) {
+
+	case BINARY_PING:
+		return make_binary_reply(reply, opcode, BINARY_OK, 0);
+
+	case BINARY_GET:
+		if (read_i2c_registers(i2c_handle, payload[0], payload[1], payload[2], reply_payload) != 0) break;
+		return make_binary_reply(reply, opcode, BINARY_OK, payload[2]);
+
+	case BINARY_SET:
+		if (write_i2c_register(i2c_handle, payload[0], payload[1], payload[2]) != 0) break;
+		return make_binary_reply(reply, opcode, BINARY_OK, 0);
+
+	case BINARY_SETN:
+		if (write_i2c_registers(i2c_handle, payload[0], payload[1], payload_length - 2, &payload[2]) != 0) break;
+		return make_binary_reply(reply, opcode, BINARY_OK, 0);
+
+	case BINARY_ADDPOLL:
+		if (get_le32(payload) < MIN_POLL_DELAY) {
+			fprintf(stderr, "ERROR => Poll delays must be at least %dus.\n", MIN_POLL_DELAY);
+			break;
+		}
+		if (payload_length == ADDPOLL_DELTA_PAYLOAD_SIZE) {
+			delivery.only_on_change = true;
+			delivery.deadband = payload[7];
+			delivery.max_silence = get_le32(&payload[8]);
+		}
+		else {
+			memset(&delivery, 0, sizeof(delivery));
+		}
+		put_le32(reply_payload, add_poll(get_le32(payload), payload[4], payload[5], payload[6], &delivery));
+		return make_binary_reply(reply, opcode, BINARY_OK, 4);
+
+	case BINARY_RMPOLL:
+		if (remove_poll(get_le32(payload)) != 0) break;
+		return make_binary_reply(reply, opcode, BINARY_OK, 0);
+
+	case BINARY_MGET:
+		reply_length = process_binary_mget(payload, payload_length, i2c_handle, reply_payload);
+		if (reply_length == -1) break;
+		return make_binary_reply(reply, opcode, BINARY_OK, reply_length);
+
+	case BINARY_BATCH:
+		reply_length = process_binary_batch(payload, payload_length, i2c_handle, reply_payload);
+		if (reply_length == -1) break;
+		return make_binary_reply(reply, opcode, BINARY_OK, reply_length);
+	}
+
+	return make_binary_reply(reply, opcode, BINARY_ERROR, 0);
+}
@@ -0,0 +1,66 @@
+#ifndef BINARYCOMMANDS_H
+#define BINARYCOMMANDS_H
+
+#include <stdint.h>
+
+/*
+   Once a connection's 'binary' command has been acknowledged, every request and response on it is a frame
+   made up of a fixed 4 byte header followed by a payload. All multi-byte values are little-endian.
+
+   request:  uint8 opcode, uint8 reserved (0), uint16 payload length, payload
+   response: uint8 opcode, uint8 status,       uint16 payload length, payload
+
+   opcode   request payload                                          response payload
+   PING     -                                                        -
+   GET      uint8 address, uint8 register, uint8 count               count raw register values
+   SET      uint8 address, uint8 register, uint8 value               -
+   SETN     uint8 address, uint8 register, 1 to 32 values            -
+   ADDPOLL  uint32 delay in us, uint8 address, uint8 register,       uint32 poll id
+            uint8 count, and optionally (to only send changes) 
+            uint8 deadband, uint32 max silence in us (0 for none)
+   RMPOLL   uint32 poll id                                           -
+   BATCH    one or more 4 byte operations:                           for each operation, a uint8 status 
+            uint8 opcode (GET or SET), uint8 address,                followed (for successful GETs) by 
+            uint8 register, uint8 count (GET) or value (SET)         count raw register values
+   MGET     one or more 3 byte register blocks:                      every block's raw register values, 
+            uint8 address, uint8 register, uint8 count               one block after another
+*/
+
+#define BINARY_HEADER_SIZE 4
+#define MAX_BINARY_PAYLOAD 1024
+#define BATCH_OPERATION_SIZE 4
+#define MGET_BLOCK_SIZE 3
+#define ADDPOLL_PAYLOAD_SIZE 7
+#define ADDPOLL_DELTA_PAYLOAD_SIZE 12
+
+enum binary_opcode
+{
+	BINARY_PING = 0x01,
+	BINARY_GET = 0x02,
+	BINARY_SET = 0x03,
+	BINARY_ADDPOLL = 0x04,
+	BINARY_RMPOLL = 0x05,
+	BINARY_BATCH = 0x06,
+	BINARY_MGET = 0x07,
+	BINARY_SETN = 0x08
+};
+
+enum binary_status
+{
+	BINARY_OK = 0x00,
+	BINARY_ERROR = 0x01
+};
+
+/* 
+   Returns the size of the complete frame (header and payload) at the start of buffer, 0 if more data is
+   needed to tell, or -1 if the header is invalid.
+*/
+int get_binary_frame_size(const uint8_t *buffer, int count);
+
+/* 
+   Executes the request frame, writing the response frame into reply (which must be at least 
+   BINARY_HEADER_SIZE + MAX_BINARY_PAYLOAD bytes). Returns the size of the response frame.
+*/
+int process_binary_request(const uint8_t *request, int i2c_handle, uint8_t *reply);
+
+#endif
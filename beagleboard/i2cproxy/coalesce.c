@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "coalesce.h"
+
+struct register_range
+{
+	uint8_t address;
+	int first;
+	int end;
+	int record_index;
+};
+
+static int compare_ranges(const void *a, const void *b)
+{
+	const struct register_range *x = (const struct register_range*)a;
+	const struct register_range *y = (const struct register_range*)b;
+
+	if (x->address != y->address) return x->address - y->address;
+	if (x->first != y->first) return x->first - y->first;
+	return y->end - x->end;
+}
+
+int plan_block_reads(struct poll_record **records, int num_records, struct register_block *blocks, 
+		int *record_blocks)
+{
+	struct register_range *ranges;
+	int i, num_blocks = 0, block_first = 0, block_end = 0, end;
+
+	if (num_records == 0) return 0;
+
+	/* Sort the requested ranges by slave and first register, so mergeable ones are next to each other. */
+	ranges = (struct register_range*)malloc(num_records * sizeof(struct register_range));
+	for (i = 0; i < num_records; i++) {
+		ranges[i].address = records[i]->address;
+		ranges[i].first = records[i]->reg;
+		ranges[i].end = records[i]->reg + records[i]->num_regs_to_read;
+		ranges[i].record_index = i;
+	}
+	qsort(ranges, num_records, sizeof(struct register_range), compare_ranges);
+
+	for (i = 0; i < num_records; i++) {
+		end = ranges[i].end > block_end ? ranges[i].end : block_end;
+
+		/* Start a new block unless this range extends the current one without making it too big. */
+		if (i == 0 || ranges[i].address != blocks[num_blocks - 1].address || 
+				ranges[i].first > block_end + MAX_COALESCE_GAP || end - block_first > MAX_COALESCED_REGISTERS) {
+			block_first = ranges[i].first;
+			block_end = ranges[i].end;
+			blocks[num_blocks].address = ranges[i].address;
+			blocks[num_blocks].reg = block_first;
+			num_blocks++;
+		}
+		else {
+			block_end = end;
+		}
+
+		blocks[num_blocks - 1].count = block_end - block_first;
+		record_blocks[ranges[i].record_index] = num_blocks - 1;
+	}
+
+	free(ranges);
+	return num_blocks;
+}
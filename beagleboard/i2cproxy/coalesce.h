@@ -0,0 +1,21 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include "commands.h"
+#include "prlist.h"
+
+/* The most registers a coalesced block read will cover (the SMBus block limit). */
+#define MAX_COALESCED_REGISTERS 32
+
+/* The most unrequested registers worth reading in the middle of a block, to save a separate read. */
+#define MAX_COALESCE_GAP 2
+
+/* 
+   Plans the fewest block reads that cover every record's registers, by merging records on the same slave
+   whose registers overlap or nearly touch. Fills in blocks (which must have room for num_records entries), 
+   and for each record the index of the block that contains its registers. Returns the number of blocks.
+*/
+int plan_block_reads(struct poll_record **records, int num_records, struct register_block *blocks, 
+		int *record_blocks);
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "coalesce.h"
+
+struct poll_record test_records[10];
+struct poll_record *records[10];
+struct register_block blocks[10];
+int record_blocks[10];
+int num_records = 0;
+
+void assert(bool value)
+{
+	if (!value)
+	{
+		printf("ASSERT failed\n");
+		exit(1);
+	}
+}
+
+void clear_records()
+{
+	num_records = 0;
+}
+
+void add_record(uint8_t address, uint8_t reg, uint8_t num_regs_to_read)
+{
+	struct poll_record *record = &test_records[num_records];
+	memset(record, 0, sizeof(struct poll_record));
+	record->id = num_records + 1;
+	record->address = address;
+	record->reg = reg;
+	record->num_regs_to_read = num_regs_to_read;
+	records[num_records++] = record;
+}
+
+void assert_block(int index, uint8_t address, uint8_t reg, uint8_t count)
+{
+	assert(blocks[index].address == address);
+	assert(blocks[index].reg == reg);
+	assert(blocks[index].count == count);
+}
+
+void single_record()
+{
+	printf("Starting test single_record\n");
+	clear_records();
+	add_record(0x10, 5, 2);
+
+	assert(plan_block_reads(records, num_records, blocks, record_blocks) == 1);
+	assert_block(0, 0x10, 5, 2);
+	assert(record_blocks[0] == 0);
+}
+
+void adjacent_records_are_merged()
+{
+	printf("Starting test adjacent_records_are_merged\n");
+	clear_records();
+	add_record(0x30, 0x0C, 2);
+	add_record(0x30, 0x0A, 2);
+	add_record(0x30, 0x0E, 2);
+
+	assert(plan_block_reads(records, num_records, blocks, record_blocks) == 1);
+	assert_block(0, 0x30, 0x0A, 6);
+	assert(record_blocks[0] == 0 && record_blocks[1] == 0 && record_blocks[2] == 0);
+}
+
+void overlapping_records_are_merged()
+{
+	printf("Starting test overlapping_records_are_merged\n");
+	clear_records();
+	add_record(0x10, 1, 4);
+	add_record(0x10, 2, 1);
+	add_record(0x10, 3, 4);
+
+	assert(plan_block_reads(records, num_records, blocks, record_blocks) == 1);
+	assert_block(0, 0x10, 1, 6);
+}
+
+void small_gaps_are_read_through()
+{
+	printf("Starting test small_gaps_are_read_through\n");
+	clear_records();
+	add_record(0x10, 0, 1);
+	add_record(0x10, 1 + MAX_COALESCE_GAP, 1);
+	add_record(0x10, 3 + MAX_COALESCE_GAP * 2, 1);
+
+	assert(plan_block_reads(records, num_records, blocks, record_blocks) == 2);
+	assert_block(0, 0x10, 0, 2 + MAX_COALESCE_GAP);
+	assert_block(1, 0x10, 3 + MAX_COALESCE_GAP * 2, 1);
+	assert(record_blocks[0] == 0 && record_blocks[1] == 0 && record_blocks[2] == 1);
+}
+
+void different_addresses_are_not_merged()
+{
+	printf("Starting test different_addresses_are_not_merged\n");
+	clear_records();
+	add_record(0x20, 1, 1);
+	add_record(0x10, 2, 1);
+
+	assert(plan_block_reads(records, num_records, blocks, record_blocks) == 2);
+	assert_block(0, 0x10, 2, 1);
+	assert_block(1, 0x20, 1, 1);
+	assert(record_blocks[0] == 1 && record_blocks[1] == 0);
+}
+
+void blocks_are_limited_in_size()
+{
+	printf("Starting test blocks_are_limited_in_size\n");
+	clear_records();
+	add_record(0x10, 0, MAX_COALESCED_REGISTERS - 1);
+	add_record(0x10, MAX_COALESCED_REGISTERS - 1, 2);
+	add_record(0x10, MAX_COALESCED_REGISTERS + 1, 1);
+
+	assert(plan_block_reads(records, num_records, blocks, record_blocks) == 2);
+	assert_block(0, 0x10, 0, MAX_COALESCED_REGISTERS - 1);
+	assert_block(1, 0x10, MAX_COALESCED_REGISTERS - 1, 3);
+}
+
+int main(int argc, char **argv)
+{
+	single_record();
+	adjacent_records_are_merged();
+	overlapping_records_are_merged();
+	small_gaps_are_read_through();
+	different_addresses_are_not_merged();
+	blocks_are_limited_in_size();
+
+	printf("All tests passed.\n");
+
+	return 0;
+}
@@ -5,46 +5,130 @@
 #include <string.h>
 #include "commands.h"
 #include "prlist.h"
+#include "../common/utils.h"
 
 void process_ping_command(const char *command, char *reply, int reply_size)
 {
 	strncpy(reply, "OK\r\n", reply_size);
 }
 
-void read_i2c_multiple_as_string(int i2c_handle, uint8_t address, uint8_t reg, int count, char *result, int result_size)
+int read_i2c_registers(int i2c_handle, uint8_t address, uint8_t reg, int count, uint8_t *result)
 {
-	int r, result_length, i;
-	uint8_t i2c_buffer[256];
-	char s[20];
+	int r;
 
-	if (count > sizeof(i2c_buffer)) {
+	if (count < 1 || count > MAX_REGISTERS) {
 		fprintf(stderr, "ERROR => I2C buffer too small to read that many registers.");
-		strncpy(result, "ERROR\r\n", result_size);
-		return;
+		return -1;
 	}
-	memset(i2c_buffer,0, sizeof(i2c_buffer));
-	r = read_i2c_multiple(i2c_handle, address, reg, count, true, i2c_buffer);
+	memset(result, 0, count);
+	r = read_i2c_multiple(i2c_handle, address, reg, count, true, result);
 	if (r != 0) {
 		char message[100];
 		snprintf(message, sizeof(message),
 				"ERROR => Error reading %d i2c value(s) at address=%d, register=%d. The error was", 
 				count, address, reg);
 		perror(message);
-		strncpy(result, "ERROR\r\n", result_size);
-		return;
+		return -1;
+	}
+	return 0;
+}
+
+int write_i2c_register(int i2c_handle, uint8_t address, uint8_t reg, uint8_t value)
+{
+	int result = write_i2c(i2c_handle, address, reg, value, 1);
+	if (result == -1) {
+		char message[100];
+		snprintf(message, sizeof(message),
+			"ERROR => Error writing i2c value at address=%d, register=%d. The error was", 
+			(int)address, (int)reg);
+		perror(message);
+		return -1;
+	}
+	return 0;
+}
+
+int write_i2c_registers(int i2c_handle, uint8_t address, uint8_t reg, int count, const uint8_t *values)
+{
+	if (count < 1 || count > MAX_I2C_BLOCK_WRITE) {
+		fprintf(stderr, "ERROR => Can't write %d registers in one transaction.\n", count);
+		return -1;
+	}
+	if (write_i2c_multiple(i2c_handle, address, reg, count, values, 1) == -1) {
+		char message[100];
+		snprintf(message, sizeof(message),
+			"ERROR => Error writing %d i2c value(s) at address=%d, register=%d. The error was", 
+			count, (int)address, (int)reg);
+		perror(message);
+		return -1;
 	}
+	return 0;
+}
+
+int read_i2c_register_blocks(int i2c_handle, const struct register_block *blocks, int num_blocks, uint8_t *result)
+{
+	struct i2c_message messages[MAX_I2C_MESSAGES];
+	int i;
+
+	if (num_blocks < 1 || num_blocks > MAX_REGISTER_BLOCKS) {
+		fprintf(stderr, "ERROR => Can't read %d register blocks in one transaction.\n", num_blocks);
+		return -1;
+	}
+
+	/* Each block is a write of the register number followed by a (repeated start) read of the values. */
+	for (i = 0; i < num_blocks; i++) {
+		messages[i * 2].address = blocks[i].address;
+		messages[i * 2].read = false;
+		messages[i * 2].length = 1;
+		messages[i * 2].buffer = (uint8_t*)&blocks[i].reg;
+
+		messages[i * 2 + 1].address = blocks[i].address;
+		messages[i * 2 + 1].read = true;
+		messages[i * 2 + 1].length = blocks[i].count;
+		messages[i * 2 + 1].buffer = result;
+		result += blocks[i].count;
+	}
+
+	if (transfer_i2c(i2c_handle, messages, num_blocks * 2, true) != 0) {
+		perror("ERROR => Error reading register blocks in a combined transaction. The error was");
+		return -1;
+	}
+	return 0;
+}
+
+int format_registers(const uint8_t *values, int count, char *result, int result_size)
+{
+	int result_length, i;
+	uint8_t value;
 
 	result_length = 0;
-	result[0] = 0;
 	for (i=0; i < count; i++) {
-		snprintf(s, sizeof(s), "%s%u", i == 0 ? "" : " ", i2c_buffer[i]);
-		result_length += strlen(s);
-		if (result_length + 2 >= result_size) {
+		/* Room for a separator and 3 digits, plus the trailing \r\n and terminator? */
+		if (result_length + 7 > result_size) {
 			fatal("ERROR => Overflowed result buffer.");
 		}
-		strcat(result, s);
+		if (i > 0) result[result_length++] = ' ';
+		value = values[i];
+		if (value >= 100) result[result_length++] = '0' + value / 100;
+		if (value >= 10) result[result_length++] = '0' + value / 10 % 10;
+		result[result_length++] = '0' + value % 10;
 	}
-	strcat(result, "\r\n");
+	result[result_length++] = '\r';
+	result[result_length++] = '\n';
+	result[result_length] = 0;
+
+	return result_length;
+}
+
+void read_i2c_multiple_as_string(int i2c_handle, uint8_t address, uint8_t reg, int count, char *result, int result_size)
+{
+	uint8_t i2c_buffer[MAX_REGISTERS];
+
+	if (read_i2c_registers(i2c_handle, address, reg, count, i2c_buffer) != 0) {
+		strncpy(result, "ERROR\r\n", result_size);
+		return;
+	}
+
+	format_registers(i2c_buffer, count, result, result_size);
 }
 
 void process_get_command(const char *command, int i2c_handle, char *reply, int reply_size)
@@ -73,13 +157,44 @@ void process_set_command(const char *command, int i2c_handle, char *reply, int r
 		return;
 	}
 
-	int result = write_i2c(i2c_handle, address, reg, value, 1);
-	if (result == -1) {
-		char message[100];
-		snprintf(message, sizeof(message),
-			"ERROR => Error writing i2c value at address=%d, register=%d. The error was", 
-			(int)address, (int)reg);
-		perror(message);
+	if (write_i2c_register(i2c_handle, address, reg, value) != 0) {
+		strcpy(reply, "ERROR\r\n");
+		return;
+	}
+
+	strncpy(reply, "OK\r\n", reply_size);
+}
+
+void process_setn_command(const char *command, int i2c_handle, char *reply, int reply_size)
+{
+	uint8_t values[MAX_I2C_BLOCK_WRITE + 2];
+	const char *next = &command[4];
+	char *end;
+	long value;
+	int count = 0;
+
+	/* Parse the address, register and values. */
+	while (1) {
+		while (*next == ' ') next++;
+		if (*next == 0) break;
+
+		value = strtol(next, &end, 10);
+		if (end == next || value < 0 || value > 255 || count == sizeof(values)) {
+			count = 0;
+			break;
+		}
+		values[count++] = value;
+		next = end;
+	}
+
+	if (count < 3) {
+		fprintf(stderr, "ERROR => Incorrect arguments. Expected slave address, i2c register and " \
+				"between 1 and %d values.\n", MAX_I2C_BLOCK_WRITE);
+		strcpy(reply, "ERROR\r\n");
+		return;
+	}
+
+	if (write_i2c_registers(i2c_handle, values[0], values[1], count - 2, &values[2]) != 0) {
 		strcpy(reply, "ERROR\r\n");
 		return;
 	}
@@ -87,13 +202,134 @@ void process_set_command(const char *command, int i2c_handle, char *reply, int r
 	strncpy(reply, "OK\r\n", reply_size);
 }
 
+void process_batch_command(const char *command, int i2c_handle, char *reply, int reply_size)
+{
+	char operations[COMMAND_BUFFER_SIZE], result[COMMAND_BUFFER_SIZE];
+	char *operation, *save_pointer;
+	int reply_length, result_length;
+
+	if (strlen(command) < 6 || command[5] != ' ' || strlen(command) >= sizeof(operations) + 6) {
+		fprintf(stderr, "ERROR => Incorrect arguments. Expected a list of get/set/setn operations separated by ';'.\n");
+		strcpy(reply, "ERROR\r\n");
+		return;
+	}
+	strcpy(operations, &command[6]);
+
+	/* Run each operation back to back, gathering the results onto a single line. */
+	reply_length = 0;
+	for (operation = strtok_r(operations, ";", &save_pointer); operation; 
+			operation = strtok_r(NULL, ";", &save_pointer)) {
+
+		while (*operation == ' ') operation++;
+		if (strncmp("get", operation, 3) == 0) {
+			process_get_command(operation, i2c_handle, result, sizeof(result));
+		}
+		else if (strncmp("setn", operation, 4) == 0) {
+			process_setn_command(operation, i2c_handle, result, sizeof(result));
+		}
+		else if (strncmp("set", operation, 3) == 0) {
+			process_set_command(operation, i2c_handle, result, sizeof(result));
+		}
+		else {
+			fprintf(stderr, "ERROR => Batches can only contain get, set and setn operations, not '%s'.\n", 
+					operation);
+			strcpy(result, "ERROR\r\n");
+		}
+
+		/* Replace the result's \r\n with a separator (or the reply's \r\n once it's complete). */
+		result_length = strlen(result) - 2;
+		if (reply_length + result_length + 5 > reply_size) {
+			fprintf(stderr, "ERROR => Batch results are too long for the reply buffer.\n");
+			strcpy(reply, "ERROR\r\n");
+			return;
+		}
+		if (reply_length > 0) {
+			reply[reply_length++] = ';';
+			reply[reply_length++] = ' ';
+		}
+		memcpy(&reply[reply_length], result, result_length);
+		reply_length += result_length;
+	}
+
+	if (reply_length == 0) {
+		fprintf(stderr, "ERROR => Empty batch.\n");
+		strcpy(reply, "ERROR\r\n");
+		return;
+	}
+	strcpy(&reply[reply_length], "\r\n");
+}
+
+void process_mget_command(const char *command, int i2c_handle, char *reply, int reply_size)
+{
+	struct register_block blocks[MAX_REGISTER_BLOCKS];
+	uint8_t values[MAX_REGISTER_BLOCKS * MAX_REGISTERS];
+	const char *next = &command[4];
+	char *end;
+	long value;
+	int num_blocks, num_values, i, reply_length;
+
+	/* Parse the address/register/count triples. */
+	num_blocks = 0;
+	num_values = 0;
+	while (1) {
+		while (*next == ' ') next++;
+		if (*next == 0) break;
+
+		for (i = 0; i < 3; i++) {
+			value = strtol(next, &end, 10);
+			if (end == next || value < (i == 2 ? 1 : 0) || value > 255 || num_blocks == MAX_REGISTER_BLOCKS) {
+				fprintf(stderr, "ERROR => Incorrect arguments. Expected up to %d slave address, i2c register and " \
+						"register count triples, not '%s'.\n", MAX_REGISTER_BLOCKS, command);
+				strcpy(reply, "ERROR\r\n");
+				return;
+			}
+			if (i == 0) blocks[num_blocks].address = value;
+			else if (i == 1) blocks[num_blocks].reg = value;
+			else blocks[num_blocks].count = value;
+			next = end;
+		}
+		num_values += blocks[num_blocks++].count;
+	}
+
+	/* Each value needs at most 4 characters, and each block a 2 character separator. */
+	if (num_values * 4 + num_blocks * 2 + 3 > reply_size) {
+		fprintf(stderr, "ERROR => Too many registers requested to fit in the reply.\n");
+		strcpy(reply, "ERROR\r\n");
+		return;
+	}
+
+	if (num_blocks == 0 || read_i2c_register_blocks(i2c_handle, blocks, num_blocks, values) != 0) {
+		strcpy(reply, "ERROR\r\n");
+		return;
+	}
+
+	/* Format each block's values, separating the blocks with '; '. */
+	reply_length = 0;
+	num_values = 0;
+	for (i = 0; i < num_blocks; i++) {
+		if (i > 0) {
+			reply[reply_length++] = ';';
+			reply[reply_length++] = ' ';
+		}
+		reply_length += format_registers(&values[num_values], blocks[i].count, &reply[reply_length], 
+				reply_size - reply_length) - 2;
+		num_values += blocks[i].count;
+	}
+	strcpy(&reply[reply_length], "\r\n");
+}
+
 void process_help(const char *command, char *reply, int reply_size)
 {
 	snprintf(reply, reply_size, "Valid commands are:\r\n" 
 			"ping\r\n" 
 			"get <address> <register> [register count]\r\n" 
 			"set <addreess> <register> <value>\r\n" 
-			"addpoll <delay in ms> <address> <register> [register count]\r\n" 
+			"setn <address> <register> <value> [value]...\r\n" 
+			"batch <get/set/setn operation>[; <get/set/setn operation>]...\r\n" 
+			"mget <address> <register> <register count> [<address> <register> <register count>]...\r\n" 
+			"addpoll <delay[s|ms|us]> <address> <register> [register count]\r\n" 
 			"rmpoll <poll id>\r\n" 
+			"pollstats <poll id>\r\n" 
+			"binary\r\n" 
 			"help\r\n");
 }
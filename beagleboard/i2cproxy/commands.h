@@ -1,11 +1,48 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 
+#include <stdint.h>
+#include "../common/i2c.h"
+
+/* The most registers a single get can read. */
+#define MAX_REGISTERS 256
+
+/* The size of the buffers used for a text request or response. */
+#define COMMAND_BUFFER_SIZE 1024
+
+/* The most register blocks a single combined transaction can read. */
+#define MAX_REGISTER_BLOCKS (MAX_I2C_MESSAGES / 2)
+
+/* A run of sequential registers on one slave. */
+struct register_block
+{
+	uint8_t address;
+	uint8_t reg;
+	uint8_t count;
+};
+
 void process_ping_command(const char *command, char *reply, int reply_size);
 void process_get_command(const char *command, int i2c_handle, char *reply, int reply_size);
 void process_set_command(const char *command, int i2c_handle, char *reply, int reply_size);
+void process_setn_command(const char *command, int i2c_handle, char *reply, int reply_size);
+void process_batch_command(const char *command, int i2c_handle, char *reply, int reply_size);
+void process_mget_command(const char *command, int i2c_handle, char *reply, int reply_size);
 void process_help(const char *command, char *reply, int reply_size);
 
+/* Reads/writes registers, logging any error. Return 0 if successful, or -1 otherwise. */
+int read_i2c_registers(int i2c_handle, uint8_t address, uint8_t reg, int count, uint8_t *result);
+int write_i2c_register(int i2c_handle, uint8_t address, uint8_t reg, uint8_t value);
+int write_i2c_registers(int i2c_handle, uint8_t address, uint8_t reg, int count, const uint8_t *values);
+
+/* 
+   Reads several register blocks (possibly on different slaves) in one combined transaction, storing the 
+   values one block after another in result. Returns 0 if successful, or -1 otherwise.
+*/
+int read_i2c_register_blocks(int i2c_handle, const struct register_block *blocks, int num_blocks, uint8_t *result);
+
+/* Formats register values as space separated decimals followed by \r\n. Returns the length. */
+int format_registers(const uint8_t *values, int count, char *result, int result_size);
+
 void read_i2c_multiple_as_string(int i2c_handle, uint8_t address, uint8_t reg, int count, char *result, int result_size);
 	
 #endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,13 +9,16 @@
 #include <errno.h>
 #include <limits.h>
 #include <netdb.h>
+#include <sys/epoll.h>
 #include "../common/network_utils.h"
 #include "linereader.h"
 #include "commands.h"
+#include "binarycommands.h"
 #include "pollcommands.h"
 
 #define DEFAULT_LOG_PATH "/var/log/i2cproxy.log" 
 #define BUFFER_SIZE 4096
+#define MAX_EVENTS 32
 
 void show_usage()
 {
@@ -91,74 +95,267 @@ void daemonize_process(char *log_path)
 	i=dup(i);
 }
 
+struct command_connection
+{
+	int con;
+	struct line_reader reader;
+	bool binary;
+	uint8_t input[BINARY_HEADER_SIZE + MAX_BINARY_PAYLOAD];
+	int input_count;
+	char output[BUFFER_SIZE];
+	int output_count;
+	char client_ip[INET6_ADDRSTRLEN];
+};
+
 int read_from_socket(char *buffer, int max_num_bytes_to_read, void *data)
 {
 	int handle = *(int*)data;
 	return recv(handle, buffer, max_num_bytes_to_read, 0);
 }
 
-void process_command_connection(int con, int i2c_handle, bool verbose)
+void process_command(char *request, int i2c_handle, bool verbose, char *response, int response_size)
 {
-	char request[256];
 	char *back;
-	char response[256];
 
-	struct line_reader reader;
-	init_line_reader(&reader, read_from_socket, BUFFER_SIZE, &con);
+	/* Get rid of any trailing \r or \n. */
+	back = request + strlen(request) - 1;
+	while (back >= request && (*back == '\n' || *back == '\r'))
+		*(back--) = 0;
 
-	while (1) {
+	if (verbose) printf("Request: %s\n", request);
+	if (strncmp("ping", request, 4) == 0)
+	{
+		process_ping_command(request, response, response_size);
+	} 
+	else if (strncmp("get", request, 3) == 0) {
+		process_get_command(request, i2c_handle, response, response_size);
+	}
+	else if (strncmp("setn", request, 4) == 0) {
+		process_setn_command(request, i2c_handle, response, response_size);
+	}
+	else if (strncmp("set", request, 3) == 0) {
+		process_set_command(request, i2c_handle, response, response_size);
+	}
+	else if (strncmp("mget", request, 4) == 0) {
+		process_mget_command(request, i2c_handle, response, response_size);
+	}
+	else if (strncmp("batch", request, 5) == 0) {
+		process_batch_command(request, i2c_handle, response, response_size);
+	}
+	else if (strncmp("addpoll", request, 7) == 0) {
+		process_add_poll_command(request, response, response_size);
+	}
+	else if (strncmp("pollstats", request, 9) == 0) {
+		process_poll_stats_command(request, response, response_size);
+	}
+	else if (strncmp("rmpoll", request, 5) == 0) {
+		process_remove_poll_command(request, response, response_size);
+	}
+	else if (strncmp("help", request, 4) == 0) {
+		process_help(request, response, response_size);
+	}
+	else 
+	{
+		fprintf(stderr, "ERROR: unknown command\n");
+		strcpy(response, "ERROR\r\n");
+	}
 
-		int result = read_line(&reader, request, sizeof(request));
-		if (result != 0) break;
-
-		/* Get rid of any trailing \r or \n. */
-		back = request + strlen(request) - 1;
-		while (back >= request && (*back == '\n' || *back == '\r'))
-			*(back--) = 0;
-
-		if (verbose) printf("Request: %s\n", request);
-		if (strncmp("ping", request, 4) == 0)
-		{
-			process_ping_command(request, response, sizeof(response));
-		} 
-		else if (strncmp("get", request, 3) == 0) {
-			process_get_command(request, i2c_handle, response, sizeof(response));
-		}
-		else if (strncmp("set", request, 3) == 0) {
-			process_set_command(request, i2c_handle, response, sizeof(response));
-		}
-		else if (strncmp("addpoll", request, 7) == 0) {
-			process_add_poll_command(request, response, sizeof(response));
-		}
-		else if (strncmp("rmpoll", request, 5) == 0) {
-			process_remove_poll_command(request, response, sizeof(response));
-		}
-		else if (strncmp("help", request, 4) == 0) {
-			process_help(request, response, sizeof(response));
+	if (verbose) printf("Response: %s", response);
+}
+
+/* 
+   Sends as much of the connection's pending output as the socket will take without blocking. Returns 0 
+   if the output buffer was emptied, 1 if some output is still pending, or -1 if the connection failed.
+*/
+int flush_command_connection(struct command_connection *connection)
+{
+	int num_sent;
+
+	while (connection->output_count > 0) {
+		num_sent = send(connection->con, connection->output, connection->output_count, MSG_NOSIGNAL);
+		if (num_sent == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+			perror("ERROR => Error writing to socket. The error was");
+			return -1;
 		}
-		else 
-		{
-			fprintf(stderr, "ERROR: unknown command\n");
-			strcpy(response, "ERROR\r\n");
+		connection->output_count -= num_sent;
+		memmove(connection->output, &connection->output[num_sent], connection->output_count);
+	}
+	return 0;
+}
+
+/* Appends a response to the connection's output buffer. Returns 0 if successful, or -1 if it's full. */
+int queue_output(struct command_connection *connection, const void *response, int response_size)
+{
+	if (connection->output_count + response_size > sizeof(connection->output)) {
+		fprintf(stderr, "ERROR => Command output buffer overrun.\n");
+		return -1;
+	}
+	memcpy(&connection->output[connection->output_count], response, response_size);
+	connection->output_count += response_size;
+	return 0;
+}
+
+/* 
+   Reads and executes one request line. Returns 0 if a request was processed, 1 if no complete line is 
+   available yet, or -1 if the connection should be closed.
+*/
+int process_text_request(struct command_connection *connection, int i2c_handle, bool verbose)
+{
+	char request[COMMAND_BUFFER_SIZE];
+	char response[COMMAND_BUFFER_SIZE];
+	int result;
+
+	result = read_line(&connection->reader, request, sizeof(request));
+	if (result == 5) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+		perror("ERROR => Error reading from socket. The error was");
+		return -1;
+	}
+	if (result != 0) return -1;
+
+	/* 
+	   Switching to the binary protocol is a property of the connection. The client must wait for the OK 
+	   before sending any frames, so there must be nothing buffered behind the command.
+	*/
+	if (strncmp("binary", request, 6) == 0) {
+		if (!is_empty(&connection->reader)) {
+			fprintf(stderr, "ERROR => Received data before the binary command was acknowledged.\n");
+			return queue_output(connection, "ERROR\r\n", 7);
 		}
+		if (verbose) printf("Switching %s to the binary protocol\n", connection->client_ip);
+		connection->binary = true;
+		connection->input_count = 0;
+		return queue_output(connection, "OK\r\n", 4);
+	}
 
-		if (verbose) printf("Response: %s", response);
-		result = send(con, response, strlen(response), MSG_NOSIGNAL);
-		if (result != strlen(response)) {
-			fprintf(stderr, "ERROR: Error writing to socket\n");
-			break;	
+	process_command(request, i2c_handle, verbose, response, sizeof(response));
+	return queue_output(connection, response, strlen(response));
+}
+
+/* 
+   Reads and executes one request frame. Returns 0 if a request was processed, 1 if no complete frame is 
+   available yet, or -1 if the connection should be closed.
+*/
+int process_binary_request_frame(struct command_connection *connection, int i2c_handle, bool verbose)
+{
+	uint8_t response[BINARY_HEADER_SIZE + MAX_BINARY_PAYLOAD];
+	int frame_size, response_size, num_received;
+
+	while (1) {
+		frame_size = get_binary_frame_size(connection->input, connection->input_count);
+		if (frame_size == -1) return -1;
+		if (frame_size > 0 && frame_size <= connection->input_count) break;
+
+		num_received = recv(connection->con, &connection->input[connection->input_count], 
+				sizeof(connection->input) - connection->input_count, 0);
+		if (num_received == 0) return -1;
+		if (num_received == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+			perror("ERROR => Error reading from socket. The error was");
+			return -1;
 		}
+		connection->input_count += num_received;
 	}
 
-	close_reader(&reader);
+	if (verbose) printf("Binary request: opcode=%d, length=%d\n", connection->input[0], frame_size);
+	response_size = process_binary_request(connection->input, i2c_handle, response);
+	if (verbose) printf("Binary response: status=%d, length=%d\n", response[1], response_size);
+
+	connection->input_count -= frame_size;
+	memmove(connection->input, &connection->input[frame_size], connection->input_count);
+
+	return queue_output(connection, response, response_size);
 }
 
-void process_command_connections(int port, int bus, bool verbose)
+/* 
+   Processes every complete request the connection has buffered, stopping early if the client isn't 
+   reading its responses. Returns 0 if the connection should stay open, or -1 if it should be closed. 
+*/
+int process_command_connection(struct command_connection *connection, int epoll_handle, int i2c_handle, 
+		bool verbose)
 {
-	int i2c_handle, sock, result, con;
+	struct epoll_event event;
+	int result;
+
+	while (1) {
+
+		/* Wait for the client to drain the previous responses before processing any more requests. */
+		result = flush_command_connection(connection);
+		if (result == -1) return -1;
+		if (result == 1) break;
+
+		if (connection->binary)
+			result = process_binary_request_frame(connection, i2c_handle, verbose);
+		else
+			result = process_text_request(connection, i2c_handle, verbose);
+		if (result == -1) return -1;
+		if (result == 1) break;
+	}
+
+	/* Only wait for the socket to become writable while there is output pending. */
+	event.events = connection->output_count > 0 ? EPOLLOUT : EPOLLIN;
+	event.data.ptr = connection;
+	if (epoll_ctl(epoll_handle, EPOLL_CTL_MOD, connection->con, &event) == -1) {
+		perror("ERROR => Error updating epoll registration. The error was");
+		return -1;
+	}
+
+	return 0;
+}
+
+struct command_connection *accept_command_connection(int sock, int epoll_handle)
+{
+	int con;
 	socklen_t client_address_size;
 	struct sockaddr_storage client_address;
-	char client_ip[INET6_ADDRSTRLEN];
+	struct command_connection *connection;
+	struct epoll_event event;
+
+	client_address_size = sizeof(client_address);
+	con = accept4(sock, (struct sockaddr *) &client_address, &client_address_size, SOCK_NONBLOCK);
+	if (con < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) 
+			perror("ERROR => Error attempting to accept connection. The error was");
+		return NULL;
+	}
+
+	connection = (struct command_connection*)malloc(sizeof(struct command_connection));
+	connection->con = con;
+	connection->binary = false;
+	connection->input_count = 0;
+	connection->output_count = 0;
+	get_address_ip((struct sockaddr*)&client_address, connection->client_ip, sizeof(connection->client_ip));
+	init_line_reader(&connection->reader, read_from_socket, BUFFER_SIZE, &connection->con);
+
+	event.events = EPOLLIN;
+	event.data.ptr = connection;
+	if (epoll_ctl(epoll_handle, EPOLL_CTL_ADD, con, &event) == -1) {
+		perror("ERROR => Error adding connection to epoll. The error was");
+		close_reader(&connection->reader);
+		close(con);
+		free(connection);
+		return NULL;
+	}
+
+	printf("Command connection accepted from %s\n", connection->client_ip);
+	return connection;
+}
+
+void close_command_connection(struct command_connection *connection, int epoll_handle)
+{
+	printf("Closing command connection from %s\n", connection->client_ip);
+	epoll_ctl(epoll_handle, EPOLL_CTL_DEL, connection->con, NULL);
+	close(connection->con);
+	close_reader(&connection->reader);
+	free(connection);
+}
+
+void process_command_connections(int port, int bus, bool verbose)
+{
+	int i2c_handle, sock, epoll_handle, num_events, num_connections, i;
+	struct epoll_event event, events[MAX_EVENTS];
+	struct command_connection *connection;
 
 	if (verbose) printf("Opening command I2C handle\n");
 	i2c_handle = open_i2c(bus, 1); 
@@ -172,37 +369,65 @@ void process_command_connections(int port, int bus, bool verbose)
 		exit(1);
 	}
 
-	while (1) {
-		
-		if (verbose) printf("Listening for incoming command connections\n");
+	if (listen(sock, 20) != 0 || fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1) {
+		perror("ERROR => Error attempting to listen on socket. The error was");
+		exit(1);
+	}
 
-		result = listen(sock, 20);
-		if (result != 0) {
-			fprintf(stderr, "ERROR: Error attempting to listen on socket");
-			continue;
-		}
+	epoll_handle = epoll_create1(0);
+	if (epoll_handle == -1) {
+		perror("ERROR => Error creating epoll instance. The error was");
+		exit(1);
+	}
 
-		client_address_size = sizeof(client_address);
-		con = accept(sock, (struct sockaddr *) &client_address, &client_address_size);
-		if (con < 0) {
-			fprintf(stderr, "ERROR: Error attempting to accept connection");
-			continue;
-		}
+	/* The listening socket is identified by a NULL data pointer, connections by their struct. */
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(epoll_handle, EPOLL_CTL_ADD, sock, &event) == -1) {
+		perror("ERROR => Error adding command socket to epoll. The error was");
+		exit(1);
+	}
 
-		get_address_ip((struct sockaddr*)&client_address, client_ip, sizeof(client_ip));
-		printf("Command connection accepted from %s\n", client_ip);
+	if (verbose) printf("Listening for incoming command connections\n");
+	num_connections = 0;
 
-		process_command_connection(con, i2c_handle, verbose);
+	while (1) {
 
-		printf("Closing command connection\n");
-		close(con);
+		num_events = epoll_wait(epoll_handle, events, MAX_EVENTS, -1);
+		if (num_events == -1) {
+			if (errno == EINTR) continue;
+			perror("ERROR => Error waiting for command connections. The error was");
+			break;
+		}
 
-		printf("Removing all poll records\n");
-		pr_lock("pcc");
-		pr_clear_and_free_all();
-		pr_unlock();
+		for (i = 0; i < num_events; i++) {
+
+			/* New connections. */
+			if (events[i].data.ptr == NULL) {
+				while (connection = accept_command_connection(sock, epoll_handle))
+					num_connections++;
+				continue;
+			}
+
+			/* Requests (or room to send responses) on an existing connection. */
+			connection = (struct command_connection*)events[i].data.ptr;
+			if (process_command_connection(connection, epoll_handle, i2c_handle, verbose) == 0) continue;
+
+			close_command_connection(connection, epoll_handle);
+			num_connections--;
+
+			/* Poll records belong to the clients as a group, so only clear them once the last one leaves. */
+			if (num_connections == 0) {
+				printf("Removing all poll records\n");
+				pr_lock("pcc");
+				pr_clear_and_free_all();
+				pr_unlock();
+			}
+		}
 	}
 
+	close(epoll_handle);
+
 	printf("Closing command socket\n");
 	close(sock);
 
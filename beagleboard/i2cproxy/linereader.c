@@ -50,7 +50,8 @@ int read_line(struct line_reader *reader, char *result_buffer, int result_buffer
 
 			/* Search through the line in the buffer for a new line */
 			int count = next_free_byte - next_place_to_start_scan;
-			if (count <= 0) count = buffer_size - next_place_to_start_scan;
+			if (count < 0 || count == 0 && first_used_byte == next_free_byte) 
+				count = buffer_size - next_place_to_start_scan;
 			char *index = memchr(&buffer[next_place_to_start_scan], 0x0A, count);
 
 			/* Did we find one? */
@@ -162,6 +163,17 @@ int read_line(struct line_reader *reader, char *result_buffer, int result_buffer
 			return 1;
 		}
 
+		/* Would the read have blocked (or did it fail)? */
+		if (bytesReceived < 0) {
+
+			reader->first_used_byte = first_used_byte;
+			reader->next_free_byte = next_free_byte;
+			reader->next_place_to_start_scan = next_place_to_start_scan;
+			result_buffer[0] = 0;
+
+			return 5;
+		}
+
 		/* Update the buffer indicies. */
 		if (first_used_byte == -1) next_place_to_start_scan = first_used_byte = next_free_byte;
 		next_free_byte += bytesReceived;
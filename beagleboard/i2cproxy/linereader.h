@@ -26,6 +26,8 @@ void init_line_reader(struct line_reader *reader,
    2 - the result buffer wasn't big enough.
    3 - circular buffer is full, but no \n was found.
    4 - something really bad happened.
+   5 - would block. The read function returned a negative value (eg a non-blocking socket 
+       with no data waiting, errno will be EAGAIN). Any partial line is kept for the next call.
 */
 int read_line(struct line_reader *reader, char *result_buffer, int result_buffer_size);
 
@@ -36,6 +36,12 @@ int mock_read(char *buffer, int max_num_bytes_to_read, void *data)
 		exit(1);
 	}
 
+	/* A NULL entry simulates a non-blocking read with no data waiting. */
+	if (!mock_reads_to_return[next_mock_read]) {
+		next_mock_read++;
+		return -1;
+	}
+
 	len = strlen(mock_reads_to_return[next_mock_read]);
 	if (len > max_num_bytes_to_read) {
 		fprintf(stderr, "Test data is too long\n");
@@ -332,6 +338,32 @@ void wrap_around2()
 	close_reader(&reader);
 }
 
+void would_block_keeps_partial_line()
+{
+	char result[30];
+	struct line_reader reader;
+	int failed;
+
+	printf("Starting test would_block_keeps_partial_line\n");
+	clear_mock_reads();
+	add_mock_read("te");
+	add_mock_read(NULL);
+	add_mock_read("st\n");
+
+	init_line_reader(&reader, mock_read, 20, 0);
+
+	failed = read_line(&reader, result, sizeof(result));
+	assert(failed == 5);
+	assert(!is_empty(&reader));
+
+	failed = read_line(&reader, result, sizeof(result));
+	assert(!failed);
+	assert(strcmp(result,"test\n") == 0);
+	assert(is_empty(&reader));
+
+	close_reader(&reader);
+}
+
 // Test parameters
 #define RANDOM_SEED 1
 #define SEND_BUFFER_SIZE 2000000
@@ -416,6 +448,7 @@ int main(int argc, char **argv)
 	result_buffer_too_small_one_segment();
 	result_buffer_too_small_double_segment();
 	wrap_around2();
+	would_block_keeps_partial_line();
 	random_test();
 
 	printf("All tests passed.\n");
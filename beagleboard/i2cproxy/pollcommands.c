@@ -9,11 +9,23 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <math.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "../common/utils.h"
 #include "pollcommands.h"
 #include "prlist.h"
+#include "commands.h"
+#include "coalesce.h"
 
 #define POLL_BUFFER_SIZE 4000
-#define SMALL_TIME_PERIOD 20
+
+/* The most records serviced in one pass through the schedule. */
+#define MAX_DUE_POLLS 64
+
+/* Fires when the record at the head of the schedule is due. */
+static int poll_timer = -1;
 
 struct poll_thread_args
 {
@@ -22,20 +34,13 @@ struct poll_thread_args
 	bool verbose;
 };
 
-void process_add_poll_command(const char *command, char *reply, int reply_size)
+void arm_poll_timer(int64_t time);
+
+int add_poll(int64_t delay, uint8_t address, uint8_t reg, uint8_t num_regs_to_read, 
+		const struct poll_delivery *delivery)
 {
-	int delay;
-	uint8_t address, reg, num_regs_to_read = 1, n; 
 	struct poll_record *record;
 
-	n = sscanf(command, "addpoll %d %hhd %hhd %hhd", &delay, &address, &reg, &num_regs_to_read);
-	if (n < 3 || n >> 4) {
-		fprintf(stderr, "ERROR => Incorrect arguments. Expected delay, slave address and i2c register, " \
-						"and optionally num registers.\n");
-		strcpy(reply, "ERROR\r\n");
-		return;
-	}
-
 	record = (struct poll_record*)malloc(sizeof(struct poll_record));
 	record->id = 0;
 	record->delay = delay;
@@ -43,18 +48,101 @@ void process_add_poll_command(const char *command, char *reply, int reply_size)
 	record->reg = reg;
 	record->num_regs_to_read = num_regs_to_read;
 	record->next_poll_time = 0;
+	memset(&record->stats, 0, sizeof(record->stats));
+	if (delivery) record->delivery = *delivery;
+	else memset(&record->delivery, 0, sizeof(record->delivery));
+	record->has_last_values = false;
+	record->last_sent_time = 0;
 
-	pr_lock("papc");	
+	pr_lock("ap");	
 	pr_insert(record);
+	if (pr_get_head() == record) arm_poll_timer(record->next_poll_time);
 	pr_unlock();
 
-	sprintf(reply, "OK %d\r\n", record->id);
+	return record->id;
+}
+
+int remove_poll(int id)
+{
+	struct poll_record *record;
+
+	pr_lock("rp");
+	record = pr_find(id);
+	if (record) {
+		pr_remove(record);
+		free(record);
+	}
+	pr_unlock();
+
+	if (!record) {
+		fprintf(stderr, "ERROR => Couldn't find record with id %d.\n", id);
+		return -1;
+	}
+	return 0;
+}
+
+/* 
+   Parses a poll delay: a (possibly fractional) number, optionally followed by a unit of s, ms or us. The
+   unit defaults to ms. Returns the delay in microseconds, or -1 if it isn't valid.
+*/
+int64_t parse_poll_delay(const char *text)
+{
+	char *unit;
+	double delay = strtod(text, &unit);
+
+	if (unit == text) return -1;
+	if (strcmp(unit, "s") == 0) delay *= 1000000;
+	else if (*unit == 0 || strcmp(unit, "ms") == 0) delay *= 1000;
+	else if (strcmp(unit, "us") != 0) return -1;
+
+	if (delay < MIN_POLL_DELAY || delay > MAX_POLL_DELAY) return -1;
+	return (int64_t)(delay + 0.5);
+}
+
+void process_add_poll_command(const char *command, char *reply, int reply_size)
+{
+	char delay_text[32], option[32] = "", silence_text[32] = "0";
+	int64_t delay;
+	uint8_t address, reg, num_regs_to_read = 1; 
+	struct poll_delivery delivery;
+	int n;
+
+	memset(&delivery, 0, sizeof(delivery));
+	n = sscanf(command, "addpoll %31s %hhd %hhd %hhd %31s %hhu %31s", delay_text, &address, &reg, 
+			&num_regs_to_read, option, &delivery.deadband, silence_text);
+	if (n < 3 || n > 4 && strcmp(option, "onchange") != 0) {
+		fprintf(stderr, "ERROR => Incorrect arguments. Expected delay, slave address and i2c register, " \
+						"and optionally num registers, then 'onchange' [deadband [max silence]].\n");
+		strcpy(reply, "ERROR\r\n");
+		return;
+	}
+
+	if (n > 4) {
+		delivery.only_on_change = true;
+		if (strcmp(silence_text, "0") != 0) {
+			delivery.max_silence = parse_poll_delay(silence_text);
+			if (delivery.max_silence == -1) {
+				fprintf(stderr, "ERROR => Invalid max silence '%s'.\n", silence_text);
+				strcpy(reply, "ERROR\r\n");
+				return;
+			}
+		}
+	}
+
+	delay = parse_poll_delay(delay_text);
+	if (delay == -1) {
+		fprintf(stderr, "ERROR => Invalid delay '%s'. Expected a number of s, ms (the default) or us, between " \
+						"%dus and %ds.\n", delay_text, MIN_POLL_DELAY, MAX_POLL_DELAY / 1000000);
+		strcpy(reply, "ERROR\r\n");
+		return;
+	}
+
+	snprintf(reply, reply_size, "OK %d\r\n", add_poll(delay, address, reg, num_regs_to_read, &delivery));
 }
 
 void process_remove_poll_command(const char *command, char *reply, int reply_size)
 {
 	int id_to_remove, n;
-	struct poll_record *record;
 
 	n = sscanf(command, "rmpoll %d", &id_to_remove);
 	if (n != 1) {
@@ -63,90 +151,228 @@ void process_remove_poll_command(const char *command, char *reply, int reply_siz
 		return;
 	}
 
-	pr_lock("prpc");
-	record = pr_find(id_to_remove);
-	if (record) {
-		pr_remove(record);
-		free(record);
-		strcpy(reply, "OK\r\n");
-	} else {
-		fprintf(stderr, "ERROR => Couldn't find record with id %d.\n", id_to_remove);
+	strcpy(reply, remove_poll(id_to_remove) == 0 ? "OK\r\n" : "ERROR\r\n");
+}
+
+/* 
+   Arms the poll timer to fire at the given (absolute, CLOCK_MONOTONIC) time in us, or disarms it if the
+   time is 0. Must be called with the poll record lock held, so the timer always reflects the head record.
+*/
+void arm_poll_timer(int64_t time)
+{
+	struct itimerspec timer_value;
+
+	memset(&timer_value, 0, sizeof(timer_value));
+	timer_value.it_value.tv_sec = time / 1000000;
+	timer_value.it_value.tv_nsec = (time % 1000000) * 1000;
+	if (timerfd_settime(poll_timer, TFD_TIMER_ABSTIME, &timer_value, NULL) == -1)
+		perror("ERROR => Error arming poll timer. The error was");
+}
+
+/* Records how late the poll is running, and how much that has changed since its last poll. */
+void update_poll_stats(struct poll_record *record, int64_t now)
+{
+	struct poll_stats *stats = &record->stats;
+	int64_t lateness = now - record->next_poll_time;
+	int64_t jitter;
+
+	if (stats->num_polls > 0) {
+		jitter = lateness - stats->last_lateness;
+		if (jitter < 0) jitter = -jitter;
+		if (jitter > stats->max_jitter) stats->max_jitter = jitter;
+		stats->total_jitter_squared += (double)jitter * jitter;
+	}
+
+	stats->num_polls++;
+	stats->last_lateness = lateness;
+	stats->total_lateness += lateness;
+	if (lateness > stats->max_lateness) stats->max_lateness = lateness;
+}
+
+void process_poll_stats_command(const char *command, char *reply, int reply_size)
+{
+	int id, n;
+	struct poll_record *record;
+	struct poll_stats stats;
+
+	n = sscanf(command, "pollstats %d", &id);
+	if (n != 1) {
+		fprintf(stderr, "ERROR => Incorrect arguments. Expected id of poll record.\n");
 		strcpy(reply, "ERROR\r\n");
+		return;
 	}
+
+	pr_lock("ppsc");
+	record = pr_find(id);
+	if (record) stats = record->stats;
 	pr_unlock();
 
+	if (!record) {
+		fprintf(stderr, "ERROR => Couldn't find record with id %d.\n", id);
+		strcpy(reply, "ERROR\r\n");
+		return;
+	}
+
+	snprintf(reply, reply_size, "%ld %ld %lld %lld %.0f %lld\r\n", stats.num_polls, stats.num_skipped, 
+			stats.num_polls > 0 ? (long long)(stats.total_lateness / stats.num_polls) : 0LL,
+			(long long)stats.max_lateness,
+			stats.num_polls > 1 ? sqrt(stats.total_jitter_squared / (stats.num_polls - 1)) : 0.0,
+			(long long)stats.max_jitter);
 }
 
-void process_poll_connection(int con, int i2c_handle)
+/* 
+   Takes every record that is due off the schedule (up to MAX_DUE_POLLS), recording its timing and moving 
+   it on to its next deadline. Must be called with the poll record lock held. Returns the number of records.
+*/
+int take_due_polls(struct poll_record **due)
 {
-	int num_sent, delay, response_buffer_count, r, result_length, num_periods, i;
 	struct poll_record *current;
-	uint8_t i2c_buffer[256];
-	char result[1000], response_buffer[POLL_BUFFER_SIZE], s[18];
-	long time_till_next_run;
+	int64_t now = get_time_in_us(), num_periods;
+	int num_due = 0;
+
+	while ((current = pr_get_head()) && current->next_poll_time <= now && num_due < MAX_DUE_POLLS) {
+
+		update_poll_stats(current, now);
+		due[num_due++] = current;
+
+		/* The next deadline is always a whole number of periods on, skipping any polls we've missed. */
+		current->next_poll_time += current->delay;
+		if (current->next_poll_time <= now) {
+			num_periods = (now - current->next_poll_time) / current->delay + 1;
+			fprintf(stderr, "WARNING: had to skip %lld polls for poll ID %d\n", (long long)num_periods, 
+					current->id);
+			current->next_poll_time += num_periods * current->delay;
+			current->stats.num_skipped += num_periods;
+		}
+	
+		/* Move the record to its new place in the schedule. */	
+		pr_reschedule(current);
+	}
 
-	/* Repeat until the connection is closed. */
-	while (1)
-	{
-		response_buffer[0] = 0;
-		response_buffer_count = 0;
+	return num_due;
+}
 
-		/* Loop until there are no more PollRecords due to run. */
-		pr_lock("ppc");
-		while (current = pr_get_head()) {
+/* 
+   Decides whether a successful sample should be sent to the client, given the record's delivery settings,
+   remembering it as the last value sent if so.
+*/
+bool should_send_sample(struct poll_record *record, const uint8_t *values, int64_t now)
+{
+	struct poll_delivery *delivery = &record->delivery;
+	bool changed = !record->has_last_values;
+	int i;
+
+	if (delivery->only_on_change) {
+		for (i = 0; i < record->num_regs_to_read && !changed; i++)
+			changed = abs(values[i] - record->last_values[i]) > delivery->deadband;
+		if (!changed && (delivery->max_silence == 0 || now - record->last_sent_time < delivery->max_silence)) 
+			return false;
+	}
+
+	memcpy(record->last_values, values, record->num_regs_to_read);
+	record->has_last_values = true;
+	record->last_sent_time = now;
+	return true;
+}
 
-			/* Is the poll_record at the head of the list not due to run yet? */
-			if (current && current->next_poll_time > get_time_in_ms() + SMALL_TIME_PERIOD) break;
+/* 
+   Reads the registers for the due records, merging records on the same slave into shared block reads, and
+   formats a result line for each one into response_buffer. Returns the number of bytes written.
+*/
+int read_due_polls(int i2c_handle, struct poll_record **due, int num_due, char *response_buffer, 
+		int response_buffer_size)
+{
+	struct register_block blocks[MAX_DUE_POLLS];
+	int record_blocks[MAX_DUE_POLLS];
+	uint8_t values[MAX_DUE_POLLS][MAX_REGISTERS];
+	bool block_failed[MAX_DUE_POLLS];
+	char result[1000];
+	int num_blocks, response_buffer_count = 0, result_length, i;
+	struct poll_record *current;
+	struct register_block *block;
+	const uint8_t *record_values;
+	int64_t now;
+
+	num_blocks = plan_block_reads(due, num_due, blocks, record_blocks);
+	for (i = 0; i < num_blocks; i++) {
+		block_failed[i] = read_i2c_registers(i2c_handle, blocks[i].address, blocks[i].reg, blocks[i].count, 
+				values[i]) != 0;
+	}
+	now = get_time_in_us();
 
-			snprintf(result, sizeof(result), "%d: ", current->id);
-			result_length = strlen(result);
+	for (i = 0; i < num_due; i++) {
+		current = due[i];
+		block = &blocks[record_blocks[i]];
 
-			/* Query the I2C values. */
-			read_i2c_multiple_as_string(i2c_handle, current->address, current->reg, current->num_regs_to_read, 
-					&result[result_length], sizeof(result) - result_length);
+		/* Pick the record's registers back out of the block that covered them. */
+		result_length = snprintf(result, sizeof(result), "%d: ", current->id);
+		if (block_failed[record_blocks[i]]) {
+			strcpy(&result[result_length], "ERROR\r\n");
+			result_length += 7;
+		}
+		else {
+			record_values = &values[record_blocks[i]][current->reg - block->reg];
+			if (!should_send_sample(current, record_values, now)) continue;
+			result_length += format_registers(record_values, current->num_regs_to_read, &result[result_length], 
+					sizeof(result) - result_length);
+		}
 
-			/* Add the string to the result_buffer, to be sent out over the network later. */
-			result_length = strlen(result);
-			if (response_buffer_count + result_length >= sizeof(response_buffer)) {
-				fprintf(stderr, "ERROR => Poll buffer overrun.");
-				break;
-			}
-			strcpy(&response_buffer[response_buffer_count], result);
-			response_buffer_count += result_length;
-			
-			/* Calculate the new poll time. */
-			current->next_poll_time += current->delay;
-			time_till_next_run = current->next_poll_time - get_time_in_ms();
-			if (time_till_next_run < SMALL_TIME_PERIOD) {
-				num_periods = ceilf((float)(SMALL_TIME_PERIOD - time_till_next_run) / current->delay);
-				fprintf(stderr, "WARNING: had to skip %d polls for poll ID %d\n", num_periods, current->id);
-				current->next_poll_time += num_periods * current->delay;
-			}
-		
-			/* Reinsert the record at the appropriate place in the list */	
-			pr_remove(current);
-			pr_insert(current);
+		/* Add the string to the result_buffer, to be sent out over the network later. */
+		if (response_buffer_count + result_length >= response_buffer_size) {
+			fprintf(stderr, "ERROR => Poll buffer overrun.");
+			break;
 		}
-		pr_unlock();
+		memcpy(&response_buffer[response_buffer_count], result, result_length);
+		response_buffer_count += result_length;
+	}
 
-		/* If the buffer isn't empty, send it to the client. */
-		if (response_buffer_count > 0) {
-			num_sent = send(con, response_buffer, response_buffer_count, MSG_NOSIGNAL);
-			if (num_sent == -1) {
-				perror("ERROR => Error sending poll buffer. The error was");
-				break;
+	return response_buffer_count;
+}
+
+void process_poll_connection(int con, int i2c_handle)
+{
+	int num_sent, response_buffer_count, num_due;
+	struct poll_record *current, *due[MAX_DUE_POLLS];
+	char response_buffer[POLL_BUFFER_SIZE], discard[256];
+	struct pollfd fds[2];
+	uint64_t num_expirations;
+
+	fds[0].fd = poll_timer;
+	fds[0].events = POLLIN;
+	fds[1].fd = con;
+	fds[1].events = POLLIN;
+
+	/* Repeat until the connection is closed. */
+	while (1)
+	{
+		/* Service every record that is due, a tick's worth at a time. */
+		pr_lock("ppc");
+		while ((num_due = take_due_polls(due)) > 0) {
+			response_buffer_count = read_due_polls(i2c_handle, due, num_due, response_buffer, 
+					sizeof(response_buffer));
+
+			/* If the buffer isn't empty, send it to the client. */
+			if (response_buffer_count > 0) {
+				num_sent = send(con, response_buffer, response_buffer_count, MSG_NOSIGNAL);
+				if (num_sent == -1) {
+					perror("ERROR => Error sending poll buffer. The error was");
+					pr_unlock();
+					return;
+				}
 			}
 		}
+		current = pr_get_head();
+		arm_poll_timer(current ? current->next_poll_time : 0);
+		pr_unlock();
 
-		/* How long to the next poll_record is due to run? */
-		if (current) {
-			delay = (current->next_poll_time - get_time_in_ms()) * 1000;
+		/* Sleep until the next deadline (or a new record is added), watching for the client disconnecting. */
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR) continue;
+			perror("ERROR => Error waiting for the poll timer. The error was");
+			break;
 		}
-		else {
-			delay = 1000000;
-		}
-
-		usleep(delay);
+		if (fds[1].revents && recv(con, discard, sizeof(discard), MSG_DONTWAIT) <= 0) break;
+		if (fds[0].revents) read(poll_timer, &num_expirations, sizeof(num_expirations));
 	}
 }
 
@@ -223,6 +449,12 @@ void start_poll_thread(int port, int bus, bool verbose)
 	struct poll_thread_args *args;
 	pthread_t poll_thread;
 
+	poll_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (poll_timer == -1) {
+		perror("ERROR => Error creating poll timer. The error was");
+		exit(1);
+	}
+
 	args = (struct poll_thread_args *)malloc(sizeof(struct poll_thread_args));
 	args->bus = bus;
 	args->port = port;
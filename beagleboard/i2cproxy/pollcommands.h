@@ -2,9 +2,27 @@
 #define POLLTHREAD_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include "prlist.h"
+
+/* The range of poll delays accepted, in microseconds. */
+#define MIN_POLL_DELAY 100
+#define MAX_POLL_DELAY 3600000000LL
+
+/* 
+   Adds a poll record, returning its id. The delay is in microseconds. If delivery is NULL, every sample is
+   sent to the client.
+*/
+int add_poll(int64_t delay, uint8_t address, uint8_t reg, uint8_t num_regs_to_read, 
+		const struct poll_delivery *delivery);
+
+/* Removes (and frees) a poll record. Returns 0 if successful, or -1 if there's no such record. */
+int remove_poll(int id);
+
 
 void process_add_poll_command(const char *command, char *reply, int reply_size);
 void process_remove_poll_command(const char *command, char *reply, int reply_size);
+void process_poll_stats_command(const char *command, char *reply, int reply_size);
 void start_poll_thread(int port, int bus, bool verbose);
 
 #endif
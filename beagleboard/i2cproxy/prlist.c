@@ -8,11 +8,21 @@
 #include "prlist.h"
 #include "../common/utils.h"
 
+#define INITIAL_CAPACITY 64
+
 static int next_free_id = 1;
-struct poll_record *head = NULL;
 pthread_mutex_t list_mutex; 
 char *lock_owner = NULL;
 
+/* The heap, with the record due to run first at heap[0]. */
+static struct poll_record **heap = NULL;
+static int heap_count = 0;
+static int heap_capacity = 0;
+
+/* A chained hash table of the records, keyed on id. */
+static struct poll_record **buckets = NULL;
+static int num_buckets = 0;
+
 void pr_init()
 {
 	pthread_mutexattr_t attr;
@@ -28,6 +38,14 @@ void pr_init()
 
 	if (pthread_mutexattr_destroy(&attr)) 
 		perror("ERROR => Error attempting to destroy mutexattr. The error was");
+
+	heap_capacity = INITIAL_CAPACITY;
+	heap = (struct poll_record**)malloc(heap_capacity * sizeof(struct poll_record*));
+
+	num_buckets = INITIAL_CAPACITY;
+	buckets = (struct poll_record**)calloc(num_buckets, sizeof(struct poll_record*));
+
+	if (!heap || !buckets) fatal("Couldn't allocate the poll record heap.");
 }
 
 void pr_lock(char *new_lock_owner)
@@ -44,10 +62,77 @@ void pr_unlock()
 	pthread_mutex_unlock(&list_mutex);
 }
 
+static inline int hash_id(int id)
+{
+	return id & (num_buckets - 1);
+}
+
+static void add_to_index(struct poll_record *record)
+{
+	int bucket = hash_id(record->id);
+	record->next_with_same_hash = buckets[bucket];
+	buckets[bucket] = record;
+}
+
+static void remove_from_index(struct poll_record *record)
+{
+	struct poll_record **link = &buckets[hash_id(record->id)];
+	while (*link && *link != record) link = &(*link)->next_with_same_hash;
+	if (*link) *link = record->next_with_same_hash;
+	record->next_with_same_hash = NULL;
+}
+
+/* Doubles the number of buckets, keeping the average chain length below one. */
+static void grow_index()
+{
+	int i;
+
+	free(buckets);
+	num_buckets *= 2;
+	buckets = (struct poll_record**)calloc(num_buckets, sizeof(struct poll_record*));
+	if (!buckets) fatal("Couldn't grow the poll record index.");
+
+	for (i = 0; i < heap_count; i++) add_to_index(heap[i]);
+}
+
+static inline void place(struct poll_record *record, int index)
+{
+	heap[index] = record;
+	record->heap_index = index;
+}
+
+static void sift_up(struct poll_record *record)
+{
+	int index = record->heap_index;
+	int parent;
+
+	while (index > 0) {
+		parent = (index - 1) / 2;
+		if (heap[parent]->next_poll_time <= record->next_poll_time) break;
+		place(heap[parent], index);
+		index = parent;
+	}
+	place(record, index);
+}
+
+static void sift_down(struct poll_record *record)
+{
+	int index = record->heap_index;
+	int child;
+
+	while ((child = index * 2 + 1) < heap_count) {
+		if (child + 1 < heap_count && heap[child + 1]->next_poll_time < heap[child]->next_poll_time) child++;
+		if (record->next_poll_time <= heap[child]->next_poll_time) break;
+		place(heap[child], index);
+		index = child;
+	}
+	place(record, index);
+}
+
 struct poll_record *pr_get_head()
 {
 	assert(lock_owner);
-	return head;
+	return heap_count > 0 ? heap[0] : NULL;
 }
 
 void pr_insert(struct poll_record *record)
@@ -59,91 +144,78 @@ void pr_insert(struct poll_record *record)
 
 	/* Work out the next run time. */
 	if (record->next_poll_time == 0) {
-		record->next_poll_time = ceilf((float)get_time_in_ms() / 1000) * 1000;
+		record->next_poll_time = (get_time_in_us() / 1000000 + 1) * 1000000;
 	}
 
-	/* Is the list empty? */
-	if (!head)
-	{
-		head = record;
-		record->prev = record->next = 0;
-		return;
+	if (heap_count == heap_capacity) {
+		heap_capacity *= 2;
+		heap = (struct poll_record**)realloc(heap, heap_capacity * sizeof(struct poll_record*));
+		if (!heap) fatal("Couldn't grow the poll record heap.");
 	}
 
-	/* Find the first existing record that is set to run AFTER this one. */
-	struct poll_record *current = (struct poll_record*)head;
-    struct poll_record *last = NULL;
-	while (current && current->next_poll_time < record->next_poll_time) {
-		last = current;
-		current = current->next;
-	}
+	record->heap_index = heap_count++;
+	sift_up(record);
 
-	/* Do we need to insert it at the head of the list? */
-	if (last == NULL) {
-		record->prev = NULL;
-		record->next = current;
-		head = record;
-		current->prev = record;
-	}
-	/* Do we need to insert it at the tail of the list? */
-	else if (current == NULL) {
-		last->next = record;
-		record->prev = last;
-		record->next = NULL;
-	}
-	/* Otherwise, insert it between last and current. */
-	else {
-		record->prev = last;
-		record->next = current;
-		last->next = record;
-		current->prev = record;
-	}
+	if (heap_count > num_buckets) grow_index();
+	else add_to_index(record);
 }
 
 void pr_remove(struct poll_record *record)
 {
+	struct poll_record *last;
+
 	assert(record);
 	assert(lock_owner);
 
-	if (head == record) {
-		head = record->next;
-		if (record->next) record->next->prev = NULL;
+	if (record->heap_index < 0 || record->heap_index >= heap_count || heap[record->heap_index] != record) {
+		fprintf(stderr, "record isn't in list.");
+		return;
 	}
-	else {
-		if (!record->prev) {
-			fprintf(stderr, "record isn't in list.");
-			return;
-		}
-		record->prev->next = record->next;
-		if (record->next) record->next->prev = record->prev;
+
+	/* Fill the hole with the last record, and move that to wherever it now belongs. */
+	last = heap[--heap_count];
+	if (last != record) {
+		last->heap_index = record->heap_index;
+		pr_reschedule(last);
 	}
-	record->next = NULL;
-	record->prev = NULL;
+
+	remove_from_index(record);
+	record->heap_index = -1;
+}
+
+void pr_reschedule(struct poll_record *record)
+{
+	assert(record);
+	assert(lock_owner);
+
+	place(record, record->heap_index);
+	if (record->heap_index > 0 && 
+			heap[(record->heap_index - 1) / 2]->next_poll_time > record->next_poll_time)
+		sift_up(record);
+	else
+		sift_down(record);
 }
 
 struct poll_record *pr_find(int id)
 {
 	assert(lock_owner);
 
-	struct poll_record *current = (struct poll_record *)head;
+	struct poll_record *current = buckets[hash_id(id)];
 	while (current) {
 		if (current->id == id) return current;
-		current = current->next;
+		current = current->next_with_same_hash;
 	}
 	return NULL;
 }
 
 void pr_clear_and_free_all()
 {
+	int i;
+
 	assert(lock_owner);
 
-	struct poll_record *current, *next;
-	current = head;
-	while (current) {
-		next = current->next;
-		free(current);
-		current = next;
-	}
-	head = NULL;
-}
+	for (i = 0; i < heap_count; i++) free(heap[i]);
+	heap_count = 0;
 
+	for (i = 0; i < num_buckets; i++) buckets[i] = NULL;
+}
@@ -1,18 +1,50 @@
 #ifndef POLLRECORD_H
 #define POLLRECORD_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 extern int poll_record_next_free_id;
 
+/* How closely a poll record has kept to its schedule. Times are in microseconds. */
+struct poll_stats
+{
+	long num_polls;
+	long num_skipped;
+	int64_t last_lateness;
+	int64_t total_lateness;
+	int64_t max_lateness;
+	double total_jitter_squared;
+	int64_t max_jitter;
+};
+
+/* 
+   Which samples are sent to the client. By default every sample is sent; with only_on_change, a sample is
+   only sent if a register has moved by more than deadband since the last one sent, or if max_silence (in 
+   microseconds, 0 for no limit) has passed without sending anything.
+*/
+struct poll_delivery
+{
+	bool only_on_change;
+	uint8_t deadband;
+	int64_t max_silence;
+};
+
 struct poll_record
 {
 	int id;
-	long next_poll_time;
-	int delay;
+	int64_t next_poll_time;	/* CLOCK_MONOTONIC time of the next poll, in microseconds. */
+	int64_t delay;			/* Time between polls, in microseconds. */
 	uint8_t address;
 	uint8_t reg;
 	uint8_t num_regs_to_read;
-	struct poll_record *prev;
-	struct poll_record *next;
+	struct poll_stats stats;
+	struct poll_delivery delivery;
+	bool has_last_values;
+	uint8_t last_values[256];	/* The values last sent to the client. */
+	int64_t last_sent_time;
+	int heap_index;
+	struct poll_record *next_with_same_hash;
 } ;
 
 void pr_init();
@@ -20,10 +52,23 @@ void pr_init();
 void pr_lock();
 void pr_unlock();
 
+/* The poll records are kept in a binary min-heap ordered by next_poll_time, and indexed by id. */
+
+/* Returns the record that is due to run first, or NULL if there are none. O(1). */
 struct poll_record *pr_get_head();
+
+/* Assigns the record an id (and first poll time) if it doesn't already have one, and adds it. O(log n). */
 void pr_insert(struct poll_record *record);
+
+/* Removes the record without freeing it. O(log n). */
 void pr_remove(struct poll_record *record);
+
+/* Moves the record to its new place after its next_poll_time has been changed. O(log n). */
+void pr_reschedule(struct poll_record *record);
+
+/* Returns the record with the given id, or NULL if there isn't one. O(1). */
 struct poll_record *pr_find(int id);
+
 void pr_clear_and_free_all();
 
 #endif
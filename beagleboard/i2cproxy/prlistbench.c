@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "prlist.h"
+
+/* Benchmark parameters */
+#define RANDOM_SEED 1
+#define NUM_RECORDS 10000
+#define NUM_TICKS 10000
+#define TICK_PERIOD 1000
+#define NUM_FINDS 100000
+
+const int64_t delays[] = { 10000, 20000, 50000, 100000, 250000, 1000000 };
+
+double get_elapsed_ns(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+	struct poll_record *record;
+	struct timespec start, end;
+	int64_t now;
+	long num_polls = 0;
+	int i, ids_found = 0;
+	double elapsed;
+
+	srand(RANDOM_SEED);
+	pr_init();
+	pr_lock("bench");
+
+	/* Add the poll records, spreading their first poll times over the longest delay. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NUM_RECORDS; i++) {
+		record = (struct poll_record*)calloc(1, sizeof(struct poll_record));
+		record->delay = delays[rand() % (sizeof(delays) / sizeof(delays[0]))];
+		record->next_poll_time = (1 + rand() % 1000) * TICK_PERIOD;
+		record->address = 0x10;
+		record->num_regs_to_read = 1;
+		pr_insert(record);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("Inserted %d poll records in %.0f ns per record\n", NUM_RECORDS, 
+			get_elapsed_ns(&start, &end) / NUM_RECORDS);
+
+	/* Run the schedule the way the poll thread does, on a simulated clock. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (now = TICK_PERIOD; now <= NUM_TICKS * TICK_PERIOD; now += TICK_PERIOD) {
+		while ((record = pr_get_head()) && record->next_poll_time <= now) {
+			if (record->next_poll_time != now) {
+				printf("ERROR => Poll record %d ran late\n", record->id);
+				return 1;
+			}
+			record->next_poll_time += record->delay;
+			pr_reschedule(record);
+			num_polls++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = get_elapsed_ns(&start, &end);
+	printf("Ran %d ticks (%ld polls) in %.0f ns per tick, %.0f ns per poll\n", NUM_TICKS, num_polls, 
+			elapsed / NUM_TICKS, elapsed / num_polls);
+
+	/* Look up random ids, the way rmpoll does. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NUM_FINDS; i++) {
+		if (pr_find(1 + rand() % NUM_RECORDS)) ids_found++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("Found %d ids in %.0f ns per lookup\n", ids_found, get_elapsed_ns(&start, &end) / NUM_FINDS);
+
+	/* Remove every record in id order (ie from arbitrary places in the heap). */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 1; i <= NUM_RECORDS; i++) {
+		record = pr_find(i);
+		pr_remove(record);
+		free(record);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("Removed %d poll records in %.0f ns per record\n", NUM_RECORDS, 
+			get_elapsed_ns(&start, &end) / NUM_RECORDS);
+
+	if (pr_get_head()) {
+		printf("ERROR => Records left over after removing them all\n");
+		return 1;
+	}
+
+	pr_unlock();
+	return 0;
+}
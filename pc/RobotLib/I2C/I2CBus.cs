@@ -19,6 +19,7 @@ namespace MongooseSoftware.Robotics.RobotLib.I2C
 
         public const int CommandSocketBufferSize = 4000;
         public const int PollSocketBufferSize = 4000;
+        public const int MaxBlockWriteRegisters = 32;
 
         #endregion
 
@@ -144,6 +145,21 @@ namespace MongooseSoftware.Robotics.RobotLib.I2C
             }
         }
 
+        public void Set(byte slaveAddress, byte register, byte[] values)
+        {
+            lock (socketLock)
+            {
+                if (values == null || values.Length < 1 || values.Length > MaxBlockWriteRegisters) throw new ArgumentException("values is invalid");
+
+                var request = String.Format("setn {0} {1} {2}", slaveAddress, register, String.Join(" ", Array.ConvertAll(values, v => v.ToString())));
+                SendLine(request);
+
+                var response = ReadLine();
+                if (response != "OK")
+                    throw new I2CException(String.Format("Unexpected response '{0}'.", response));
+            }
+        }
+
         public byte Get(byte slaveAddress, byte register)
         {
             lock (socketLock)
@@ -49,6 +49,16 @@ namespace MongooseSoftware.Robotics.RobotLib.I2C
         /// <exception cref="I2CException">Thrown if the I2C operation fails, or the network connection fails.</exception>
         /// <returns></returns>
         void Set(byte slaveAddress, byte register, byte value);
+
+        /// <summary>
+        /// Writes values to sequential I2C registers on the target system, in a single bus transaction.
+        /// </summary>
+        /// <param name="slaveAddress"></param>
+        /// <param name="register">The first register to write to.</param>
+        /// <param name="values">Between 1 and 32 values, written to register, register + 1, etc.</param>
+        /// <exception cref="I2CException">Thrown if the I2C operation fails, or the network connection fails.</exception>
+        /// <returns></returns>
+        void Set(byte slaveAddress, byte register, byte[] values);
        
         /// <summary>
         /// Reads values from the given I2C register(s) every delayInMilliseconds, calling the pollCallback delegate with the result. If there